@@ -0,0 +1,94 @@
+// Client header for the TouchpadTablet shared-memory position feed.
+//
+// TouchpadTablet publishes the latest mapped position into a named
+// shared-memory block guarded by a seqlock. Applications and overlays can
+// map the block once and then read positions without any syscalls. The
+// touchpad's measured report timing is published alongside:
+//
+//     touchpad_feed* feed = OpenTouchpadFeed();
+//     touchpad_position pos;
+//     touchpad_timing timing;
+//     if (feed && ReadTouchpadFeed(feed, &pos, &timing)) { ... }
+//     CloseTouchpadFeed(feed);
+#pragma once
+
+#include <windows.h>
+#include <atomic>
+
+#define TOUCHPAD_FEED_NAME "Local\\TouchpadTabletFeed"
+#define TOUCHPAD_FEED_VERSION 3
+
+// A single published position.
+struct touchpad_position
+{
+    double x; // Screen position in pixels, before rounding
+    double y;
+    ULONGLONG time; // Device timestamp in 100us units
+    ULONGLONG sequence; // Increases by one for every published position or lift
+    ULONG contacts; // Tip-down contacts, 0 once all contacts lifted
+};
+
+// Report timing measured from the touchpad's scan time.
+struct touchpad_timing
+{
+    double reportRate; // Report rate in Hz, 0 if the device has no scan time
+    ULONGLONG gaps; // Times one or more reports went missing
+    ULONGLONG dropped; // Estimated number of missing reports
+    ULONGLONG delayed; // Reports that arrived late, including stalls
+};
+
+// Layout of the shared-memory block. The lock counter is odd while the
+// writer is updating the block.
+struct touchpad_feed
+{
+    std::atomic<ULONG> lock;
+    ULONG version;
+    touchpad_position position;
+    touchpad_timing timing;
+};
+
+// Maps the feed published by a running TouchpadTablet. Returns nullptr
+// if it isn't running or publishes an incompatible version.
+inline touchpad_feed* OpenTouchpadFeed()
+{
+    HANDLE hMapping = OpenFileMappingA(FILE_MAP_READ, FALSE, TOUCHPAD_FEED_NAME);
+    if (hMapping == NULL) {
+        return nullptr;
+    }
+    touchpad_feed* feed = (touchpad_feed*)MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, sizeof(touchpad_feed));
+    // The view keeps the mapping alive
+    CloseHandle(hMapping);
+    if (feed != nullptr && feed->version != TOUCHPAD_FEED_VERSION) {
+        UnmapViewOfFile(feed);
+        return nullptr;
+    }
+    return feed;
+}
+
+inline void CloseTouchpadFeed(touchpad_feed* feed)
+{
+    if (feed != nullptr) {
+        UnmapViewOfFile(feed);
+    }
+}
+
+// Reads the latest position and, optionally, the report timing. Returns
+// false if nothing has been published yet.
+inline bool ReadTouchpadFeed(const touchpad_feed* feed, touchpad_position* pos, touchpad_timing* timing = nullptr)
+{
+    ULONG before, after;
+    do {
+        before = feed->lock.load(std::memory_order_acquire);
+        if (before & 1) {
+            YieldProcessor();
+            continue;
+        }
+        *pos = feed->position;
+        if (timing != nullptr) {
+            *timing = feed->timing;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        after = feed->lock.load(std::memory_order_relaxed);
+    } while ((before & 1) || before != after);
+    return pos->sequence != 0;
+}
@@ -2,6 +2,7 @@
 #include <string>
 #include <sstream>
 #include <fstream>
+#include <cmath>
 #include <windows.h>
 #include <stdio.h>
 #include <hidsdi.h>
@@ -10,10 +11,29 @@
 #include <unordered_map>
 #include <optional>
 #include "resource.h"
+#include "TouchpadFeed.h"
 
 #define WMAPP_NOTIFYCALLBACK (WM_APP + 1)
 #define HID_USAGE_DIGITIZER_CONTACT_ID 0x51
 #define HID_USAGE_DIGITIZER_CONTACT_COUNT 0x54
+#define HID_USAGE_DIGITIZER_SCAN_TIME 0x56
+
+// How often (in reports) the input counters are dumped in debug mode
+#define STATS_REPORT_INTERVAL 1000
+// Maximum number of simultaneous contacts injected in touch passthrough mode
+#define MAX_TOUCH_COUNT 10
+// Host time (in 100us scan time units) between reports after which the
+// scan time is resynced instead of treating the difference as a gap
+#define SCAN_TIME_RESYNC 1000
+// Consecutive over-long intervals after which the device is assumed to
+// have changed its report rate rather than dropped reports
+#define SCAN_RATE_CHANGE_GAPS 4
+// Fixed point scale of correction grid nodes. Nodes are limited to
+// [-1, 2], so they fit in 27 bits and interpolation fits in 64 bits.
+#define GRID_FRAC_BITS 24
+#define GRID_ONE (1 << GRID_FRAC_BITS)
+// Largest number of nodes along either side of the correction grid
+#define GRID_MAX_NODES 256
 
 #define DEBUG_MODE 0
 
@@ -28,6 +48,8 @@ float width = 110;
 float height = 51;
 float awidth = 110;
 float aheight = 51;
+// Inject all contacts as touch input instead of moving the mouse
+bool touchPassthrough = false;
 
 int swidth = GetSystemMetrics(SM_CXSCREEN);
 int sheight = GetSystemMetrics(SM_CYSCREEN);
@@ -44,6 +66,7 @@ struct contact
     contact_info info;
     ULONG id;
     POINT point;
+    ULONGLONG time; // Device timestamp in 100us units
 };
 
 // Wrapper for malloc with unique_ptr semantics, to allow
@@ -51,6 +74,31 @@ struct contact
 struct free_deleter { void operator()(void* ptr) { free(ptr); } };
 template<typename T> using malloc_ptr = std::unique_ptr<T, free_deleter>;
 
+// Timeline built from the 16-bit scan time (in 100us units) that precision
+// touchpads attach to each report. Devices without a scan time fall back
+// to host arrival times.
+struct scan_timeline
+{
+    bool started = false;
+    USHORT lastScanTime = 0; // Last raw scan time
+    ULONGLONG lastHostTime = 0; // Host arrival time of the last report
+    ULONGLONG time = 0; // Unwrapped device time
+    ULONGLONG reportTime = 0; // Device time of the decoded report in the last event
+    double interval = 0; // Smoothed report interval
+    ULONG pendingGaps = 0; // Consecutive over-long intervals not yet counted
+    ULONGLONG pendingDropped = 0; // Missing reports for the pending gaps
+    ULONGLONG gaps = 0; // Times one or more reports went missing
+    ULONGLONG dropped = 0; // Estimated number of missing reports
+    ULONGLONG delayed = 0; // Reports that arrived over an interval late
+};
+
+// Decoder a report is dispatched to, by report ID.
+enum class report_decoder : UCHAR
+{
+    ignore, // Mouse-mode, vendor or other reports we don't parse
+    touch, // Precision touchpad input report with contacts
+};
+
 // Device information, such as touch area bounds and HID offsets.
 // This can be reused across HID events, so we only have to parse
 // this info once.
@@ -59,6 +107,25 @@ struct device_info
     malloc_ptr<_HIDP_PREPARSED_DATA> preparsedData; // HID internal data
     USHORT linkContactCount = 0; // Link collection for number of contacts present
     std::vector<contact_info> contactInfo; // Link collection and touch area for each contact
+    bool hasContacts = false; // Whether the last decoded report had tip-down contacts
+    bool hasScanTime = false; // Whether the device reports a scan time usage
+    USHORT linkScanTime = 0; // Link collection for the scan time
+    UCHAR scanTimeReportId = 0; // Report ID carrying the scan time
+    scan_timeline timeline; // Device-side timing of received reports
+    bool usesReportIds = false; // Whether reports are prefixed with a report ID
+    report_decoder decoders[256] = {}; // Decoder for each report ID
+    ULONGLONG reportCounts[256] = {}; // Reports received for each report ID
+};
+
+// Counters for the input pipeline, dumped periodically in debug mode.
+struct input_stats
+{
+    ULONGLONG reports = 0; // WM_INPUT reports handled
+    ULONGLONG empty = 0; // Reports with a zero contact count, decoded no further
+    ULONGLONG suppressed = 0; // Injections skipped because the output didn't change
+    ULONGLONG injected = 0; // SendInput calls made
+    ULONGLONG ignored = 0; // Reports dropped by report ID before parsing
+    LONGLONG decodeTicks = 0; // QPC ticks spent decoding contacts
 };
 
 // Caches per-device info for better performance
@@ -67,6 +134,53 @@ static std::unordered_map<HANDLE, device_info> g_devices;
 // Holds the current primary touch point ID
 static thread_local ULONG t_primaryContactID;
 
+// Last absolute position passed to SendInput, reset when all contacts lift
+static std::optional<POINT> g_lastInjected;
+
+static input_stats g_stats;
+
+// A touch injection slot. Contacts keep the same slot (and therefore the
+// same injected pointer ID) for as long as they stay down.
+struct touch_slot
+{
+    bool active = false;
+    ULONG id = 0; // HID contact ID occupying this slot
+    POINT point = {}; // Last injected screen position
+};
+
+// Fixed-size slot table and frame buffer so that passthrough mode
+// doesn't allocate per report
+static touch_slot g_touchSlots[MAX_TOUCH_COUNT];
+static POINTER_TOUCH_INFO g_touchFrame[MAX_TOUCH_COUNT];
+
+// Touch injection only exists on Windows 8+, so it is loaded at runtime
+// to keep the exe starting on Windows 7
+typedef BOOL(WINAPI* InitializeTouchInjection_t)(UINT32, DWORD);
+typedef BOOL(WINAPI* InjectTouchInput_t)(UINT32, const POINTER_TOUCH_INFO*);
+static InjectTouchInput_t g_injectTouchInput;
+
+// Shared-memory position feed for client applications, see TouchpadFeed.h
+static touchpad_feed* g_feed;
+
+// One cell of the nonlinear correction grid. The four corners are stored
+// together (top-left, top-right, bottom-left, bottom-right) so a lookup
+// only touches a single cache line. Values are corrected positions within
+// the calibrated bounds, in fixed point with GRID_ONE at the right/bottom edge.
+struct alignas(32) grid_cell
+{
+    INT32 x[4];
+    INT32 y[4];
+};
+
+// Correction grid loaded from tpgrid.dat. Empty if no correction is used.
+struct correction_grid
+{
+    UINT cols = 0; // Number of cells horizontally
+    UINT rows = 0; // Number of cells vertically
+    std::vector<grid_cell> cells; // Row-major
+};
+static correction_grid g_grid;
+
 // Allocates a malloc_ptr with the given size. The size must be
 // greater than or equal to sizeof(T).
 template<typename T>
@@ -162,6 +276,70 @@ void Clean() {
     PostQuitMessage(0);
 }
 
+// Creates the shared-memory position feed. The feed is optional, so
+// failures only disable it.
+static void CreateTouchpadFeed()
+{
+    // The seqlock only supports a single writer. Clients can keep the
+    // mapping itself alive across restarts, so ownership is tracked with
+    // a mutex that goes away with the instance holding it.
+    HANDLE hWriter = CreateMutex(NULL, FALSE, TOUCHPAD_FEED_NAME "Writer");
+    if (hWriter == NULL) {
+        debugf("CreateMutex failed: %lu", GetLastError());
+        return;
+    }
+    DWORD wait = WaitForSingleObject(hWriter, 0);
+    if (wait != WAIT_OBJECT_0 && wait != WAIT_ABANDONED) {
+        debugf("Another instance is publishing the position feed");
+        CloseHandle(hWriter);
+        return;
+    }
+
+    // The mutex and mapping handles are kept open for the lifetime of the process
+    HANDLE hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(touchpad_feed), TOUCHPAD_FEED_NAME);
+    if (hMapping == NULL) {
+        debugf("CreateFileMapping failed: %lu", GetLastError());
+        return;
+    }
+    g_feed = (touchpad_feed*)MapViewOfFile(hMapping, FILE_MAP_WRITE, 0, 0, sizeof(touchpad_feed));
+    if (g_feed == nullptr) {
+        debugf("MapViewOfFile failed: %lu", GetLastError());
+        CloseHandle(hMapping);
+        return;
+    }
+    // A previous writer may have exited in the middle of an update
+    ULONG lock = g_feed->lock.load(std::memory_order_relaxed);
+    if (lock & 1) {
+        g_feed->lock.store(lock + 1, std::memory_order_release);
+    }
+    g_feed->version = TOUCHPAD_FEED_VERSION;
+}
+
+// Publishes a new position and the device's report timing to the
+// shared-memory feed. A contact count of 0 publishes a lift and keeps
+// the last position.
+static void WriteTouchpadFeed(ULONG contacts, double x, double y, ULONGLONG time, const scan_timeline& timeline)
+{
+    if (g_feed == nullptr) {
+        return;
+    }
+    ULONG lock = g_feed->lock.load(std::memory_order_relaxed);
+    g_feed->lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    if (contacts != 0) {
+        g_feed->position.x = x;
+        g_feed->position.y = y;
+    }
+    g_feed->position.time = time;
+    g_feed->position.sequence++;
+    g_feed->position.contacts = contacts;
+    g_feed->timing.reportRate = timeline.interval != 0 ? 10000 / timeline.interval : 0;
+    g_feed->timing.gaps = timeline.gaps;
+    g_feed->timing.dropped = timeline.dropped;
+    g_feed->timing.delayed = timeline.delayed;
+    g_feed->lock.store(lock + 2, std::memory_order_release);
+}
+
 // Registers the specified window to receive touchpad HID events.
 static void RegisterTouchpadInput()
 {
@@ -236,6 +414,9 @@ static std::vector<HIDP_BUTTON_CAPS> GetHidInputButtonCaps(PHIDP_PREPARSED_DATA
     }
     USHORT numCaps = caps.NumberInputButtonCaps;
     std::vector<HIDP_BUTTON_CAPS> buttonCaps(numCaps);
+    if (numCaps == 0) {
+        return buttonCaps;
+    }
     status = HidP_GetButtonCaps(HidP_Input, &buttonCaps[0], &numCaps, preparsedData);
     if (status != HIDP_STATUS_SUCCESS) {
         throw;
@@ -256,6 +437,9 @@ static std::vector<HIDP_VALUE_CAPS> GetHidInputValueCaps(PHIDP_PREPARSED_DATA pr
     }
     USHORT numCaps = caps.NumberInputValueCaps;
     std::vector<HIDP_VALUE_CAPS> valueCaps(numCaps);
+    if (numCaps == 0) {
+        return valueCaps;
+    }
     status = HidP_GetValueCaps(HidP_Input, &valueCaps[0], &numCaps, preparsedData);
     if (status != HIDP_STATUS_SUCCESS) {
         throw;
@@ -374,6 +558,9 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
     // is actually a contact, as specified by:
     // https://docs.microsoft.com/en-us/windows-hardware/design/component-guidelines/windows-precision-touchpad-required-hid-top-level-collections
     for (const HIDP_VALUE_CAPS& cap : GetHidInputValueCaps(dev.preparsedData.get())) {
+        if (cap.ReportID != 0) {
+            dev.usesReportIds = true;
+        }
         if (cap.IsRange || !cap.IsAbsolute) {
             continue;
         }
@@ -389,6 +576,13 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
         else if (cap.UsagePage == HID_USAGE_PAGE_DIGITIZER) {
             if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_CONTACT_COUNT) {
                 linkContactCount = cap.LinkCollection;
+                // Only reports carrying a contact count are touch reports
+                dev.decoders[cap.ReportID] = report_decoder::touch;
+            }
+            else if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_SCAN_TIME) {
+                dev.hasScanTime = true;
+                dev.linkScanTime = cap.LinkCollection;
+                dev.scanTimeReportId = cap.ReportID;
             }
             else if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_CONTACT_ID) {
                 contacts[cap.LinkCollection].hasContactID = true;
@@ -397,6 +591,9 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
     }
 
     for (const HIDP_BUTTON_CAPS& cap : GetHidInputButtonCaps(dev.preparsedData.get())) {
+        if (cap.ReportID != 0) {
+            dev.usesReportIds = true;
+        }
         if (cap.UsagePage == HID_USAGE_PAGE_DIGITIZER) {
             if (cap.NotRange.Usage == HID_USAGE_DIGITIZER_TIP_SWITCH) {
                 contacts[cap.LinkCollection].hasTip = true;
@@ -404,8 +601,13 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
         }
     }
 
+    // Composite devices may have touchpad collections without contacts.
+    // Cache them with every report ID ignored so their reports are
+    // dropped without parsing the descriptor again.
     if (!linkContactCount.has_value()) {
-        throw std::runtime_error("No contact count usage found");
+        debugf("No contact count usage found for device %p", hDevice);
+        std::fill(std::begin(dev.decoders), std::end(dev.decoders), report_decoder::ignore);
+        return g_devices[hDevice] = std::move(dev);
     }
     dev.linkContactCount = linkContactCount.value();
 
@@ -419,21 +621,19 @@ static device_info& GetDeviceInfo(HANDLE hDevice)
             dev.contactInfo.push_back({ link});
         }
     }
+    if (dev.contactInfo.empty()) {
+        std::fill(std::begin(dev.decoders), std::end(dev.decoders), report_decoder::ignore);
+    }
 
     return g_devices[hDevice] = std::move(dev);
 }
 
-// Reads all touch contact points from a raw input event.
-static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
+// Reads the number of contacts present in a raw input event.
+static ULONG GetContactCount(device_info& dev, RAWINPUT* input)
 {
-    std::vector<contact> contacts;
-
-    DWORD sizeHid = input->data.hid.dwSizeHid;
-    DWORD count = input->data.hid.dwCount;
-    BYTE* rawData = input->data.hid.bRawData;
-    if (count == 0) {
+    if (input->data.hid.dwCount == 0) {
         debugf("Raw input contained no HID events");
-        return contacts;
+        return 0;
     }
 
     ULONG numContacts = GetHidUsageLogicalValue(
@@ -442,13 +642,24 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
         dev.linkContactCount,
         HID_USAGE_DIGITIZER_CONTACT_COUNT,
         dev.preparsedData.get(),
-        rawData,
-        sizeHid);
+        input->data.hid.bRawData,
+        input->data.hid.dwSizeHid);
 
     if (numContacts > dev.contactInfo.size()) {
         debugf("Device reported more contacts (%u) than we have links (%zu)", numContacts, dev.contactInfo.size());
         numContacts = (ULONG)dev.contactInfo.size();
     }
+    return numContacts;
+}
+
+// Reads all touch contact points from a raw input event, given the
+// contact count already read by GetContactCount.
+static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input, ULONG numContacts)
+{
+    std::vector<contact> contacts;
+
+    DWORD sizeHid = input->data.hid.dwSizeHid;
+    BYTE* rawData = input->data.hid.bRawData;
 
     // It's a little ambiguous as to whether contact count includes
     // released contacts. I interpreted the specs as a yes, but this
@@ -497,12 +708,180 @@ static std::vector<contact> GetContacts(device_info& dev, RAWINPUT* input)
             sizeHid);
 
         if (x != -1 && y != -1)
-            contacts.push_back({ info, id, { x, y } });
+            contacts.push_back({ info, id, { x, y }, dev.timeline.reportTime });
     }
 
     return contacts;
 }
 
+// Returns the host time in 100us units, matching the scan time unit.
+static ULONGLONG GetHostTime()
+{
+    static LARGE_INTEGER freq = {};
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (ULONGLONG)(now.QuadPart / freq.QuadPart) * 10000 +
+        (ULONGLONG)(now.QuadPart % freq.QuadPart) * 10000 / freq.QuadPart;
+}
+
+// Reads the scan time from a single HID report. Returns false if the
+// report doesn't carry it, e.g. when a composite device puts it in a
+// different report than the one given.
+static bool GetScanTime(device_info& dev, BYTE* report, ULONG reportLen, USHORT* scanTime)
+{
+    if (dev.usesReportIds && report[0] != dev.scanTimeReportId) {
+        return false;
+    }
+    ULONG value;
+    NTSTATUS status = HidP_GetUsageValue(
+        HidP_Input,
+        HID_USAGE_PAGE_DIGITIZER,
+        dev.linkScanTime,
+        HID_USAGE_DIGITIZER_SCAN_TIME,
+        &value,
+        dev.preparsedData.get(),
+        (PCHAR)report,
+        reportLen);
+    if (status != HIDP_STATUS_SUCCESS) {
+        return false;
+    }
+    *scanTime = (USHORT)value;
+    return true;
+}
+
+// Advances the device timeline by one report with the given scan time.
+// hostDelta is the host time since the previous raw input event, which
+// is 0 for the later reports of a batched event.
+static void AdvanceScanTimeline(device_info& dev, USHORT scanTime, ULONGLONG hostDelta)
+{
+    scan_timeline& tl = dev.timeline;
+
+    // After a pause the scan time may have wrapped any number of times
+    // (or been reset by the device), so just continue from host time
+    if (!tl.started || hostDelta > SCAN_TIME_RESYNC) {
+        // Pausing while contacts were still down is a stall, not the
+        // device going quiet after a lift
+        if (tl.started && dev.hasContacts) {
+            tl.delayed++;
+        }
+        tl.time = tl.started ? tl.time + hostDelta : tl.lastHostTime;
+        tl.started = true;
+        tl.lastScanTime = scanTime;
+        return;
+    }
+
+    // Unsigned 16-bit subtraction unwraps the rollover
+    ULONG delta = (USHORT)(scanTime - tl.lastScanTime);
+    tl.lastScanTime = scanTime;
+    tl.time += delta;
+
+    // A lift followed by a quick re-touch (e.g. a double tap) leaves a
+    // pause that isn't a gap, so only measure while contacts are down
+    if (delta == 0 || !dev.hasContacts) {
+        return;
+    }
+
+    if (tl.interval == 0) {
+        tl.interval = delta;
+        return;
+    }
+    if (delta > tl.interval * 1.5) {
+        // Keep over-long intervals pending, several in a row mean the
+        // device has settled at a slower rate
+        tl.pendingGaps++;
+        tl.pendingDropped += (ULONGLONG)(delta / tl.interval + 0.5) - 1;
+        if (tl.pendingGaps >= SCAN_RATE_CHANGE_GAPS) {
+            tl.interval = delta;
+            tl.pendingGaps = 0;
+            tl.pendingDropped = 0;
+        }
+        return;
+    }
+    tl.gaps += tl.pendingGaps;
+    tl.dropped += tl.pendingDropped;
+    tl.pendingGaps = 0;
+    tl.pendingDropped = 0;
+    if (hostDelta > delta + tl.interval) {
+        tl.delayed++;
+    }
+    tl.interval += (delta - tl.interval) / 8;
+}
+
+// Advances the device timeline with the scan times of a raw input event,
+// measuring the report interval and counting dropped or delayed reports.
+// Only the first report of a batched event is decoded for contacts, but
+// all of them advance the timeline so they don't look like drops.
+static void UpdateScanTimeline(device_info& dev, RAWINPUT* input)
+{
+    scan_timeline& tl = dev.timeline;
+    ULONGLONG hostTime = GetHostTime();
+    ULONGLONG hostDelta = hostTime - tl.lastHostTime;
+    tl.lastHostTime = hostTime;
+
+    DWORD sizeHid = input->data.hid.dwSizeHid;
+    USHORT scanTime;
+    if (!dev.hasScanTime || input->data.hid.dwCount == 0 ||
+        !GetScanTime(dev, input->data.hid.bRawData, sizeHid, &scanTime)) {
+        tl.time = tl.reportTime = hostTime;
+        return;
+    }
+
+    AdvanceScanTimeline(dev, scanTime, hostDelta);
+    tl.reportTime = tl.time;
+    for (DWORD i = 1; i < input->data.hid.dwCount; ++i) {
+        if (GetScanTime(dev, input->data.hid.bRawData + i * sizeHid, sizeHid, &scanTime)) {
+            AdvanceScanTimeline(dev, scanTime, 0);
+        }
+    }
+}
+
+// Looks up the decoder for a raw input event by its report ID and
+// counts the report.
+static report_decoder GetReportDecoder(device_info& dev, RAWINPUT* input)
+{
+    if (input->data.hid.dwCount == 0 || input->data.hid.dwSizeHid == 0) {
+        return report_decoder::ignore;
+    }
+    // Without report IDs the first byte is already report data
+    BYTE reportId = dev.usesReportIds ? input->data.hid.bRawData[0] : 0;
+    dev.reportCounts[reportId]++;
+    return dev.decoders[reportId];
+}
+
+// Dumps the input counters every STATS_REPORT_INTERVAL reports.
+static void ReportStats(const device_info& dev)
+{
+    if (g_stats.reports % STATS_REPORT_INTERVAL == 0) {
+        debugf("Reports %llu: ignored %llu, empty %llu, suppressed %llu, injected %llu",
+            g_stats.reports,
+            g_stats.ignored,
+            g_stats.empty,
+            g_stats.suppressed,
+            g_stats.injected);
+#if DEBUG_MODE
+        LARGE_INTEGER freq;
+        QueryPerformanceFrequency(&freq);
+        debugf("Contact decode: %.1f us per 1000 reports",
+            g_stats.decodeTicks * 1e6 / freq.QuadPart * 1000 / g_stats.reports);
+#endif
+        for (int i = 0; i < 256; ++i) {
+            if (dev.reportCounts[i] != 0) {
+                debugf("Report ID %d: %llu", i, dev.reportCounts[i]);
+            }
+        }
+        if (dev.hasScanTime && dev.timeline.interval != 0) {
+            debugf("Report rate %.1f Hz: gaps %llu, dropped %llu, delayed %llu",
+                10000 / dev.timeline.interval,
+                dev.timeline.gaps,
+                dev.timeline.dropped,
+                dev.timeline.delayed);
+        }
+    }
+}
+
 // Returns the primary contact for a given list of contacts. This is
 // necessary since we are mapping potentially many touches to a single
 // mouse position. Currently this just stores a global contact ID and
@@ -594,12 +973,268 @@ void ReadConfig() {
                     awidth = std::stof(s[1].c_str());
                 else if (s[0] == "AreaHeight")
                     aheight = std::stof(s[1].c_str());
+                else if (s[0] == "TouchPassthrough")
+                    touchPassthrough = std::stoi(s[1].c_str()) != 0;
             }
         }
         debugf("Loaded config.txt");
     }
 }
 
+// Finds the grid cell for a physical position. The position inside the
+// cell is returned at full physical resolution, as a remainder out of
+// the bounds width/height.
+static const grid_cell& GetGridCell(POINT point, LONGLONG* rx, LONGLONG* ry)
+{
+    LONGLONG w = (LONGLONG)bounds.right - bounds.left;
+    LONGLONG h = (LONGLONG)bounds.bottom - bounds.top;
+    LONGLONG nx = max(0LL, min((LONGLONG)point.x - bounds.left, w)) * g_grid.cols;
+    LONGLONG ny = max(0LL, min((LONGLONG)point.y - bounds.top, h)) * g_grid.rows;
+    LONGLONG cx = min(nx / w, (LONGLONG)g_grid.cols - 1);
+    LONGLONG cy = min(ny / h, (LONGLONG)g_grid.rows - 1);
+    *rx = nx - cx * w;
+    *ry = ny - cy * h;
+    return g_grid.cells[(size_t)cy * g_grid.cols + (size_t)cx];
+}
+
+// Interpolates between a and b by num/den.
+static LONGLONG GridLerp(LONGLONG a, LONGLONG b, LONGLONG num, LONGLONG den)
+{
+    return a + (b - a) * num / den;
+}
+
+// Corrects a physical position with the nonlinear correction grid using
+// bilinear interpolation in fixed point.
+static POINT ApplyGridCorrection(POINT point)
+{
+    if (g_grid.cells.empty() || bounds.right <= bounds.left || bounds.bottom <= bounds.top) {
+        return point;
+    }
+    LONGLONG w = (LONGLONG)bounds.right - bounds.left;
+    LONGLONG h = (LONGLONG)bounds.bottom - bounds.top;
+    LONGLONG rx, ry;
+    const grid_cell& c = GetGridCell(point, &rx, &ry);
+    LONGLONG x = GridLerp(GridLerp(c.x[0], c.x[1], rx, w), GridLerp(c.x[2], c.x[3], rx, w), ry, h);
+    LONGLONG y = GridLerp(GridLerp(c.y[0], c.y[1], rx, w), GridLerp(c.y[2], c.y[3], rx, w), ry, h);
+    // Round back to physical units so that an identity grid is exact
+    return {
+        bounds.left + (LONG)((x * w + GRID_ONE / 2) >> GRID_FRAC_BITS),
+        bounds.top + (LONG)((y * h + GRID_ONE / 2) >> GRID_FRAC_BITS) };
+}
+
+// Tells the user why tpgrid.dat wasn't used. The mapping stays linear.
+static void RejectCorrectionGrid(const std::string& reason)
+{
+    debugf("Rejected tpgrid.dat: %s", reason.c_str());
+    std::string message = "tpgrid.dat was ignored: " + reason;
+    MessageBox(hwnd, message.c_str(), "TouchpadTablet", MB_OK | MB_ICONWARNING);
+}
+
+// Reads the nonlinear correction grid from tpgrid.dat. The first line
+// holds the number of grid nodes across and down, followed by one line
+// per node (row-major) with the corrected "x y" position of that node,
+// normalized to the calibrated bounds. Without the file the mapping
+// stays linear.
+void ReadCorrectionGrid() {
+    std::ifstream input("tpgrid.dat");
+    if (!input.good()) {
+        return;
+    }
+
+    std::string line;
+    std::getline(input, line);
+    std::istringstream header(line);
+    LONGLONG nodesX, nodesY;
+    std::string extra;
+    if (!(header >> nodesX >> nodesY) || (header >> extra)) {
+        RejectCorrectionGrid("the first line must be the node count across and down");
+        return;
+    }
+    if (nodesX < 2 || nodesY < 2 || nodesX > GRID_MAX_NODES || nodesY > GRID_MAX_NODES) {
+        RejectCorrectionGrid("the node counts must be between 2 and " + std::to_string(GRID_MAX_NODES));
+        return;
+    }
+
+    // Nodes are limited to [-1, 2] so the fixed point interpolation in
+    // ApplyGridCorrection can't overflow
+    std::vector<POINT> nodes;
+    for (int lineNumber = 2; std::getline(input, line); ++lineNumber) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        std::istringstream node(line);
+        double x, y;
+        if (!(node >> x >> y) || (node >> extra)) {
+            RejectCorrectionGrid("line " + std::to_string(lineNumber) + " is not an \"x y\" node");
+            return;
+        }
+        if (!(x >= -1 && x <= 2 && y >= -1 && y <= 2)) {
+            RejectCorrectionGrid("line " + std::to_string(lineNumber) + " is outside [-1, 2]");
+            return;
+        }
+        nodes.push_back({ (LONG)llround(x * GRID_ONE), (LONG)llround(y * GRID_ONE) });
+    }
+    if (nodes.size() != (size_t)(nodesX * nodesY)) {
+        RejectCorrectionGrid("expected " + std::to_string(nodesX * nodesY) + " nodes but found " + std::to_string(nodes.size()));
+        return;
+    }
+
+    g_grid.cols = (UINT)nodesX - 1;
+    g_grid.rows = (UINT)nodesY - 1;
+    g_grid.cells.resize((size_t)g_grid.cols * g_grid.rows);
+    for (UINT j = 0; j < g_grid.rows; ++j) {
+        for (UINT i = 0; i < g_grid.cols; ++i) {
+            grid_cell& c = g_grid.cells[(size_t)j * g_grid.cols + i];
+            const POINT corners[4] = {
+                nodes[(size_t)j * nodesX + i],
+                nodes[(size_t)j * nodesX + i + 1],
+                nodes[(size_t)(j + 1) * nodesX + i],
+                nodes[(size_t)(j + 1) * nodesX + i + 1],
+            };
+            for (int k = 0; k < 4; ++k) {
+                c.x[k] = corners[k].x;
+                c.y[k] = corners[k].y;
+            }
+        }
+    }
+    debugf("Loaded %ux%u correction grid", g_grid.cols, g_grid.rows);
+
+#if DEBUG_MODE
+    // Report the largest displacement the grid applies, sampled on a
+    // 64x64 lattice over the calibrated bounds
+    if (bounds.right > bounds.left && bounds.bottom > bounds.top) {
+        double maxDist = 0;
+        for (LONG j = 0; j < 64; ++j) {
+            for (LONG i = 0; i < 64; ++i) {
+                POINT sample = {
+                    bounds.left + (bounds.right - bounds.left) * i / 63,
+                    bounds.top + (bounds.bottom - bounds.top) * j / 63 };
+                POINT corrected = ApplyGridCorrection(sample);
+                double dx = corrected.x - sample.x;
+                double dy = corrected.y - sample.y;
+                maxDist = max(maxDist, sqrt(dx * dx + dy * dy));
+            }
+        }
+        debugf("Correction grid displaces points by up to %.1f units", maxDist);
+    }
+#endif
+}
+
+// Maps a physical touchpad position to screen pixels using the
+// calibrated bounds and the configured area.
+static void MapToScreen(POINT point, double* x, double* y)
+{
+    point = ApplyGridCorrection(point);
+    float newx = ((float)bounds.right - (float)bounds.left) * ((float)awidth / (float)width);
+    float newy = ((float)bounds.bottom - (float)bounds.top) * ((float)aheight / (float)height);
+    *x = (point.x - bounds.left - ((((float)bounds.right - (float)bounds.left) - newx) / 2)) * ((float)swidth / newx);
+    *y = (point.y - bounds.top - ((((float)bounds.bottom - (float)bounds.top) - newy) / 2)) * ((float)sheight / newy);
+}
+
+// Fills in a touch injection entry for the given slot.
+static void SetTouchFrameEntry(POINTER_TOUCH_INFO& info, UINT32 slot, POINT point, POINTER_FLAGS flags)
+{
+    info = { 0 };
+    info.pointerInfo.pointerType = PT_TOUCH;
+    info.pointerInfo.pointerId = slot;
+    info.pointerInfo.pointerFlags = flags;
+    info.pointerInfo.ptPixelLocation = point;
+    info.touchFlags = TOUCH_FLAG_NONE;
+    info.touchMask = TOUCH_MASK_NONE;
+}
+
+// Injects all current contacts as a single touch frame. Contacts that
+// disappeared since the last frame are lifted in the same frame.
+static void InjectTouchFrame(const std::vector<contact>& contacts)
+{
+    // Work on a copy of the slots and only commit it once the frame has
+    // been injected, so a failed frame doesn't leave pointers marked as
+    // down that Windows never saw go down
+    touch_slot slots[MAX_TOUCH_COUNT];
+    std::copy(std::begin(g_touchSlots), std::end(g_touchSlots), slots);
+    bool seen[MAX_TOUCH_COUNT] = {};
+    UINT32 count = 0;
+
+    for (const contact& contact : contacts) {
+        int slot = -1;
+        for (int i = 0; i < MAX_TOUCH_COUNT; ++i) {
+            if (slots[i].active && slots[i].id == contact.id) {
+                slot = i;
+                break;
+            }
+        }
+
+        POINTER_FLAGS flags = POINTER_FLAG_UPDATE | POINTER_FLAG_INRANGE | POINTER_FLAG_INCONTACT;
+        if (slot == -1) {
+            for (int i = 0; i < MAX_TOUCH_COUNT; ++i) {
+                if (!slots[i].active) {
+                    slot = i;
+                    break;
+                }
+            }
+            if (slot == -1) {
+                debugf("No free touch slot for contact %u, ignoring", contact.id);
+                continue;
+            }
+            slots[slot].active = true;
+            slots[slot].id = contact.id;
+            flags = POINTER_FLAG_DOWN | POINTER_FLAG_INRANGE | POINTER_FLAG_INCONTACT;
+        }
+        else if (seen[slot]) {
+            debugf("Duplicate contact %u in report, ignoring", contact.id);
+            continue;
+        }
+        seen[slot] = true;
+
+        // InjectTouchInput rejects the whole frame if any contact is off
+        // screen, which happens whenever the area is smaller than the touchpad
+        double x, y;
+        MapToScreen(contact.point, &x, &y);
+        slots[slot].point = {
+            (LONG)max(0.0, min(x, (double)(swidth - 1))),
+            (LONG)max(0.0, min(y, (double)(sheight - 1))) };
+        SetTouchFrameEntry(g_touchFrame[count++], slot, slots[slot].point, flags);
+    }
+
+    // Slots freed here are only reused from the next frame on, so a
+    // pointer ID never goes down and up within one frame
+    for (int i = 0; i < MAX_TOUCH_COUNT; ++i) {
+        if (slots[i].active && !seen[i]) {
+            SetTouchFrameEntry(g_touchFrame[count++], i, slots[i].point, POINTER_FLAG_UP);
+            slots[i].active = false;
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+    if (!g_injectTouchInput(count, g_touchFrame)) {
+        debugf("InjectTouchInput failed: %lu", GetLastError());
+        return;
+    }
+    std::copy(std::begin(slots), std::end(slots), g_touchSlots);
+    g_stats.injected++;
+}
+
+// Loads and initializes touch injection. Returns false if it isn't
+// available on this version of Windows.
+static bool InitTouchInjection()
+{
+    HMODULE user32 = GetModuleHandle("user32.dll");
+    InitializeTouchInjection_t initializeTouchInjection =
+        (InitializeTouchInjection_t)GetProcAddress(user32, "InitializeTouchInjection");
+    g_injectTouchInput = (InjectTouchInput_t)GetProcAddress(user32, "InjectTouchInput");
+    if (initializeTouchInjection == nullptr || g_injectTouchInput == nullptr) {
+        debugf("Touch injection requires Windows 8 or newer");
+        return false;
+    }
+    if (!initializeTouchInjection(MAX_TOUCH_COUNT, TOUCH_FEEDBACK_DEFAULT)) {
+        debugf("InitializeTouchInjection failed: %lu", GetLastError());
+        return false;
+    }
+    return true;
+}
+
 // Handles a WM_INPUT event
 static void HandleRawInput(WPARAM* wParam, LPARAM* lParam)
 {
@@ -608,28 +1243,82 @@ static void HandleRawInput(WPARAM* wParam, LPARAM* lParam)
     RAWINPUTHEADER hdr = GetRawInputHeader(hInput);
     device_info& dev = GetDeviceInfo(hdr.hDevice);
     malloc_ptr<RAWINPUT> input = GetRawInput(hInput, hdr);
-    std::vector<contact> contacts = GetContacts(dev, input.get());
+    g_stats.reports++;
+    ReportStats(dev);
 
-    float newx = ((float)bounds.right - (float)bounds.left) * ((float)awidth / (float)width);
-    float newy = ((float)bounds.bottom - (float)bounds.top) * ((float)aheight / (float)height);
+    // Composite devices interleave mouse-mode, feature and vendor
+    // reports, drop those before touching the HID parser
+    if (GetReportDecoder(dev, input.get()) != report_decoder::touch) {
+        g_stats.ignored++;
+        return;
+    }
+
+    UpdateScanTimeline(dev, input.get());
+
+#if DEBUG_MODE
+    LARGE_INTEGER decodeStart, decodeEnd;
+    QueryPerformanceCounter(&decodeStart);
+#endif
+    // This is the idle early-out: a report with a zero contact count
+    // stops after that single read, before any per-contact decode
+    ULONG numContacts = GetContactCount(dev, input.get());
+    std::vector<contact> contacts;
+    if (numContacts != 0) {
+        contacts = GetContacts(dev, input.get(), numContacts);
+    }
+    else {
+        g_stats.empty++;
+    }
+#if DEBUG_MODE
+    QueryPerformanceCounter(&decodeEnd);
+    g_stats.decodeTicks += decodeEnd.QuadPart - decodeStart.QuadPart;
+#endif
 
     for (const contact& contact : contacts) {
         HandleCalibration(contact.point.x, contact.point.y);
     }
+    bool hadContacts = dev.hasContacts;
+    dev.hasContacts = !contacts.empty();
+
     if (contacts.empty()) {
+        if (hadContacts) {
+            WriteTouchpadFeed(0, 0, 0, dev.timeline.reportTime, dev.timeline);
+        }
+        g_lastInjected.reset();
+        // Passthrough also needs empty frames so lifted contacts get released
+        if (touchPassthrough) {
+            InjectTouchFrame(contacts);
+        }
         debugf("Found no contacts in input event");
         return;
     }
 
     contact contact = GetPrimaryContact(contacts);
     debugf("%d %d", contact.point.x, contact.point.y);
-    double x = (contact.point.x - bounds.left - ((((float)bounds.right - (float)bounds.left) - newx) / 2)) * ((float)swidth / newx);
-    double y = (contact.point.y - bounds.top - ((((float)bounds.bottom - (float)bounds.top) - newy) / 2)) * ((float)sheight / newy);
+    double x, y;
+    MapToScreen(contact.point, &x, &y);
+    WriteTouchpadFeed((ULONG)contacts.size(), x, y, contact.time, dev.timeline);
+
+    if (touchPassthrough) {
+        InjectTouchFrame(contacts);
+        return;
+    }
 
     event.type = INPUT_MOUSE;
     event.mi.dx = (long)((x * 65536) / swidth);
     event.mi.dy = (long)((y * 65536) / sheight);
     event.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE;
+
+    // A resting pen quantizes to the same position most of the time,
+    // no need to inject a move that goes nowhere
+    if (g_lastInjected.has_value() &&
+        g_lastInjected->x == event.mi.dx &&
+        g_lastInjected->y == event.mi.dy) {
+        g_stats.suppressed++;
+        return;
+    }
+    g_lastInjected = POINT{ event.mi.dx, event.mi.dy };
+    g_stats.injected++;
     SendInput(1, &event, sizeof(INPUT));
 }
 
@@ -661,13 +1350,13 @@ BOOL HasPrecisionTouchpad() {
         if (info.dwType == RIM_TYPEHID &&
             info.hid.usUsagePage == HID_USAGE_PAGE_DIGITIZER &&
             info.hid.usUsage == HID_USAGE_DIGITIZER_TOUCH_PAD) {
+            // Composite devices may expose several touchpad collections,
+            // keep looking if this one has no usable contacts
             device_info& info = GetDeviceInfo(dev.hDevice);
             if (!info.contactInfo.empty()) {
                 debugf("Detected touchpad with handle %p, %zu", dev.hDevice, info.contactInfo.size());
                 return true;
             }
-            else
-                break;
         }
     }
     return false;
@@ -747,7 +1436,13 @@ int APIENTRY wWinMain(_In_ HINSTANCE _hInstance,
     SetPriorityClass(GetCurrentProcess(), HIGH_PRIORITY_CLASS); // Reduce input lag
     AddNotificationIcon();
     ReadConfig();
+    if (touchPassthrough && !InitTouchInjection()) {
+        MessageBox(NULL, "Touch injection is not available, falling back to mouse mode", "TouchpadTablet", MB_OK | MB_ICONWARNING);
+        touchPassthrough = false;
+    }
     ReadCalibration();
+    ReadCorrectionGrid();
+    CreateTouchpadFeed();
     RegisterTouchpadInput();
 
     while (GetMessage(&msg, nullptr, 0, 0))